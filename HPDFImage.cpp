@@ -0,0 +1,444 @@
+#include "HPDFImage.h"
+#include "HPDFSimd.h"
+
+namespace
+{
+
+enum ScanFlag
+{
+	Scan_Gray	 = 0x1,		// r == g == b for every pixel
+	Scan_Bilevel = 0x2		// every pixel is pure black or pure white
+};
+
+// Clears the flags that do not hold for the pixels, alpha bytes are ignored
+uint scanPixels(const quint32 *px, int count, uint flags)
+{
+	int i = 0;
+#if defined(HPDF_SIMD_AVX2)
+	const __m256i lo = _mm256_set1_epi32(0xff);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i gray = _mm256_set1_epi32(-1);
+	__m256i bilevel = gray;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(px + i));
+		__m256i b = _mm256_and_si256(v, lo);
+		__m256i g = _mm256_and_si256(_mm256_srli_epi32(v, 8), lo);
+		__m256i r = _mm256_and_si256(_mm256_srli_epi32(v, 16), lo);
+		gray = _mm256_and_si256(gray, _mm256_and_si256(_mm256_cmpeq_epi32(b, g), _mm256_cmpeq_epi32(b, r)));
+		bilevel = _mm256_and_si256(bilevel, _mm256_or_si256(_mm256_cmpeq_epi32(b, zero), _mm256_cmpeq_epi32(b, lo)));
+	}
+	if (_mm256_movemask_epi8(gray) != -1)
+	{
+		return 0;
+	}
+	if (_mm256_movemask_epi8(bilevel) != -1)
+	{
+		flags &= ~Scan_Bilevel;
+	}
+#elif defined(HPDF_SIMD_SSE2)
+	const __m128i lo = _mm_set1_epi32(0xff);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i gray = _mm_set1_epi32(-1);
+	__m128i bilevel = gray;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(px + i));
+		__m128i b = _mm_and_si128(v, lo);
+		__m128i g = _mm_and_si128(_mm_srli_epi32(v, 8), lo);
+		__m128i r = _mm_and_si128(_mm_srli_epi32(v, 16), lo);
+		gray = _mm_and_si128(gray, _mm_and_si128(_mm_cmpeq_epi32(b, g), _mm_cmpeq_epi32(b, r)));
+		bilevel = _mm_and_si128(bilevel, _mm_or_si128(_mm_cmpeq_epi32(b, zero), _mm_cmpeq_epi32(b, lo)));
+	}
+	if (_mm_movemask_epi8(gray) != 0xffff)
+	{
+		return 0;
+	}
+	if (_mm_movemask_epi8(bilevel) != 0xffff)
+	{
+		flags &= ~Scan_Bilevel;
+	}
+#endif
+	for (; i < count && flags; ++i)
+	{
+		quint32 b = px[i] & 0xff;
+		if (b != ((px[i] >> 8) & 0xff) || b != ((px[i] >> 16) & 0xff))
+		{
+			return 0;
+		}
+		if (b != 0 && b != 0xff)
+		{
+			flags &= ~Scan_Bilevel;
+		}
+	}
+	return flags;
+}
+
+// True when every alpha byte of the row is 0xff
+bool rowOpaque(const quint32 *px, int count)
+{
+	int i = 0;
+#if defined(HPDF_SIMD_AVX2)
+	const __m256i ones = _mm256_set1_epi32(-1);
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(px + i));
+		if ((_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, ones)) & 0x88888888) != 0x88888888)
+		{
+			return false;
+		}
+	}
+#elif defined(HPDF_SIMD_SSE2)
+	const __m128i ones = _mm_set1_epi32(-1);
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(px + i));
+		if ((_mm_movemask_epi8(_mm_cmpeq_epi8(v, ones)) & 0x8888) != 0x8888)
+		{
+			return false;
+		}
+	}
+#endif
+	for (; i < count; ++i)
+	{
+		if ((px[i] >> 24) != 0xff)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// 16.16 fixed point reciprocals of the alpha values
+struct UnpremultiplyTable
+{
+	UnpremultiplyTable()
+	{
+		inv[0] = 0;
+		for (uint a = 1; a < 256; ++a)
+		{
+			inv[a] = (255 * 0x10000 + a / 2) / a;
+		}
+	}
+	uint inv[256];
+};
+
+const UnpremultiplyTable unpremultiply;
+
+inline void convertPixel(quint32 p, uchar *rgb, uchar *alpha, bool premultiplied)
+{
+	uint a = p >> 24;
+	uint r = (p >> 16) & 0xff;
+	uint g = (p >> 8) & 0xff;
+	uint b = p & 0xff;
+	if (premultiplied && a != 0xff)
+	{
+		uint inv = unpremultiply.inv[a];
+		r = qMin(255u, (r * inv + 0x8000) >> 16);
+		g = qMin(255u, (g * inv + 0x8000) >> 16);
+		b = qMin(255u, (b * inv + 0x8000) >> 16);
+	}
+	rgb[0] = r;
+	rgb[1] = g;
+	rgb[2] = b;
+	if (alpha)
+	{
+		*alpha = a;
+	}
+}
+
+// Converts a row of 0xAARRGGBB pixels into packed RGB888 and an optional alpha plane.
+// Opaque blocks are reordered in vector registers, blocks with translucent pixels
+// are un-premultiplied one pixel at a time.
+void convertRow(const quint32 *px, int count, uchar *rgb, uchar *alpha, bool premultiplied)
+{
+	int i = 0;
+#if defined(HPDF_SIMD_AVX2)
+	// Per 128-bit lane: BGRA x4 -> RGB x4 in the low 12 bytes, and the 4 alpha bytes
+	const __m256i rgbOrder = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	const __m256i alphaOrder = _mm256_setr_epi8(3, 7, 11, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		3, 7, 11, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	const __m256i ones = _mm256_set1_epi32(-1);
+	// 16-byte stores spill 4 bytes, keep two pixels of slack in the row
+	for (; i + 10 <= count; i += 8)
+	{
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(px + i));
+		if (premultiplied && (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, ones)) & 0x88888888) != 0x88888888)
+		{
+			for (int k = i; k < i + 8; ++k)
+			{
+				convertPixel(px[k], rgb + k * 3, alpha ? alpha + k : 0, premultiplied);
+			}
+			continue;
+		}
+		__m256i packed = _mm256_shuffle_epi8(v, rgbOrder);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(rgb + i * 3), _mm256_castsi256_si128(packed));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(rgb + i * 3 + 12), _mm256_extracti128_si256(packed, 1));
+		if (alpha)
+		{
+			__m256i a = _mm256_shuffle_epi8(v, alphaOrder);
+			quint32 lo = _mm_cvtsi128_si32(_mm256_castsi256_si128(a));
+			quint32 hi = _mm_cvtsi128_si32(_mm256_extracti128_si256(a, 1));
+			memcpy(alpha + i, &lo, 4);
+			memcpy(alpha + i + 4, &hi, 4);
+		}
+	}
+#elif defined(HPDF_SIMD_SSE2)
+	const __m128i ones = _mm_set1_epi32(-1);
+	const __m128i green = _mm_set1_epi32(0x0000ff00);
+	const __m128i low = _mm_set1_epi32(0xff);
+	// 32-bit stores spill 1 byte, keep one pixel of slack in the row
+	for (; i + 5 <= count; i += 4)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(px + i));
+		if (premultiplied && (_mm_movemask_epi8(_mm_cmpeq_epi8(v, ones)) & 0x8888) != 0x8888)
+		{
+			for (int k = i; k < i + 4; ++k)
+			{
+				convertPixel(px[k], rgb + k * 3, alpha ? alpha + k : 0, premultiplied);
+			}
+			continue;
+		}
+		// 0xAARRGGBB -> 0x00BBGGRR, i.e. bytes R G B 0 in memory
+		__m128i swapped = _mm_or_si128(_mm_and_si128(v, green),
+			_mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), low), _mm_slli_epi32(_mm_and_si128(v, low), 16)));
+		quint32 lanes[4];
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), swapped);
+		uchar *out = rgb + i * 3;
+		memcpy(out, &lanes[0], 4);
+		memcpy(out + 3, &lanes[1], 4);
+		memcpy(out + 6, &lanes[2], 4);
+		memcpy(out + 9, &lanes[3], 4);
+		if (alpha)
+		{
+			__m128i a = _mm_srli_epi32(v, 24);
+			a = _mm_packs_epi32(a, a);
+			a = _mm_packus_epi16(a, a);
+			quint32 packed = _mm_cvtsi128_si32(a);
+			memcpy(alpha + i, &packed, 4);
+		}
+	}
+#endif
+	for (; i < count; ++i)
+	{
+		convertPixel(px[i], rgb + i * 3, alpha ? alpha + i : 0, premultiplied);
+	}
+}
+
+// Collects the distinct colours, returns false as soon as there are more than 256
+bool collectPalette(const QImage &image, QVector<QRgb> *palette)
+{
+	QSet<QRgb> colors;
+	for (int y = 0; y < image.height(); ++y)
+	{
+		const QRgb *line = reinterpret_cast<const QRgb *>(image.constScanLine(y));
+		QRgb last = ~(line[0] | 0xff000000);
+		for (int x = 0; x < image.width(); ++x)
+		{
+			// Charts and screenshots are mostly long runs of one colour
+			QRgb color = line[x] | 0xff000000;
+			if (color == last)
+			{
+				continue;
+			}
+			last = color;
+			if (!colors.contains(color))
+			{
+				if (colors.size() == 256)
+				{
+					return false;
+				}
+				colors.insert(color);
+				palette->append(color);
+			}
+		}
+	}
+	return true;
+}
+
+// Smallest format for an opaque image, fills palette for PDFImage_Indexed
+PDFImageFormat analyzeImage(const QImage &image, QVector<QRgb> *palette)
+{
+	uint flags = Scan_Gray | Scan_Bilevel;
+	for (int y = 0; y < image.height() && flags; ++y)
+	{
+		flags = scanPixels(reinterpret_cast<const quint32 *>(image.constScanLine(y)), image.width(), flags);
+	}
+	if (flags & Scan_Bilevel)
+	{
+		return PDFImage_Bilevel;
+	}
+	if (flags & Scan_Gray)
+	{
+		return PDFImage_Gray;
+	}
+
+	palette->clear();
+	if (collectPalette(image, palette))
+	{
+		return PDFImage_Indexed;
+	}
+	palette->clear();
+	return PDFImage_RGB;
+}
+
+// 1 bit per pixel, rows padded to whole bytes, 1 is black
+QByteArray bilevelSamples(const QImage &image)
+{
+	const int lineWidth = (image.width() + 7) / 8;
+	QByteArray samples(lineWidth * image.height(), 0);
+	for (int y = 0; y < image.height(); ++y)
+	{
+		const quint32 *line = reinterpret_cast<const quint32 *>(image.constScanLine(y));
+		uchar *out = reinterpret_cast<uchar *>(samples.data()) + y * lineWidth;
+		for (int x = 0; x < image.width(); ++x)
+		{
+			if ((line[x] & 0xff) == 0)
+			{
+				out[x >> 3] |= 0x80 >> (x & 7);
+			}
+		}
+	}
+	return samples;
+}
+
+// 1 byte per pixel, taken from the blue channel of a gray image
+QByteArray graySamples(const QImage &image)
+{
+	const int w = image.width();
+	QByteArray samples(w * image.height(), Qt::Uninitialized);
+	uchar *out = reinterpret_cast<uchar *>(samples.data());
+	for (int y = 0; y < image.height(); ++y)
+	{
+		const quint32 *line = reinterpret_cast<const quint32 *>(image.constScanLine(y));
+		for (int x = 0; x < w; ++x)
+		{
+			*out++ = line[x] & 0xff;
+		}
+	}
+	return samples;
+}
+
+// True when any pixel is not fully opaque
+bool hasTranslucency(const QImage &image)
+{
+	if (!image.hasAlphaChannel())
+	{
+		return false;
+	}
+	for (int y = 0; y < image.height(); ++y)
+	{
+		if (!rowOpaque(reinterpret_cast<const quint32 *>(image.constScanLine(y)), image.width()))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// Packed RGB888, un-premultiplied; the alpha plane is filled in the same pass when requested
+QByteArray rgbSamples(const QImage &image, QByteArray *alpha = 0)
+{
+	const int w = image.width();
+	const int h = image.height();
+	const bool premultiplied = image.format() == QImage::Format_ARGB32_Premultiplied;
+	QByteArray samples(w * h * 3, Qt::Uninitialized);
+	if (alpha)
+	{
+		alpha->resize(w * h);
+	}
+	for (int y = 0; y < h; ++y)
+	{
+		convertRow(reinterpret_cast<const quint32 *>(image.constScanLine(y)), w,
+			reinterpret_cast<uchar *>(samples.data()) + y * w * 3,
+			alpha ? reinterpret_cast<uchar *>(alpha->data()) + y * w : 0, premultiplied);
+	}
+	return samples;
+}
+
+// Palette PNG encoding the image with exactly the given colours
+QByteArray indexedPng(const QImage &image, const QVector<QRgb> &palette)
+{
+	// Every colour is in the table, so the conversion maps pixels exactly
+	QImage indexed = image.convertToFormat(QImage::Format_Indexed8, palette, Qt::ThresholdDither | Qt::AvoidDither);
+
+	QByteArray png;
+	QBuffer buffer(&png);
+	buffer.open(QIODevice::WriteOnly);
+	indexed.save(&buffer, "PNG");
+	return png;
+}
+
+}
+
+PDFImageData prepareImage(const QImage &image, const QSize &maxSize)
+{
+	// Images far larger than their placed size are resampled first, smooth scaling
+	// averages the covered area when shrinking
+	QImage src = image;
+	if (maxSize.isValid() && (src.width() > maxSize.width() || src.height() > maxSize.height()))
+	{
+		src = src.scaled(qMin(src.width(), maxSize.width()), qMin(src.height(), maxSize.height()),
+			Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+	}
+
+	// 32-bit images (QImage's native formats) are read in place, anything else is expanded once
+	if (src.format() != QImage::Format_RGB32 && src.format() != QImage::Format_ARGB32
+		&& src.format() != QImage::Format_ARGB32_Premultiplied)
+	{
+		src = src.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+	}
+
+	PDFImageData data;
+	data.Width = src.width();
+	data.Height = src.height();
+	if (hasTranslucency(src))
+	{
+		// Colour and alpha are split in one pass
+		data.Format = PDFImage_RGB;
+		data.Samples = rgbSamples(src, &data.Alpha);
+		return data;
+	}
+
+	// Smallest representation that keeps every pixel
+	QVector<QRgb> palette;
+	data.Format = analyzeImage(src, &palette);
+	switch (data.Format)
+	{
+	case PDFImage_Bilevel:
+		data.Samples = bilevelSamples(src);
+		break;
+	case PDFImage_Gray:
+		data.Samples = graySamples(src);
+		break;
+	case PDFImage_Indexed:
+		data.Samples = indexedPng(src, palette);
+		break;
+	default:
+		data.Samples = rgbSamples(src);
+		break;
+	}
+	return data;
+}
+
+PDFImageJob::PDFImageJob(const QImage &image, const QSize &maxSize)
+	: m_image(image)
+	, m_maxSize(maxSize)
+{
+	setAutoDelete(false);
+}
+
+void PDFImageJob::run()
+{
+	m_data = prepareImage(m_image, m_maxSize);
+	m_image = QImage();
+	m_done.release();
+}
+
+PDFImageData PDFImageJob::result()
+{
+	m_done.acquire();
+	m_done.release();
+	return m_data;
+}
@@ -0,0 +1,47 @@
+﻿#ifndef HPDFIMAGE_H
+#define HPDFIMAGE_H
+
+#include <QtCore>
+#include <QtGui>
+
+// 图片嵌入格式，按数据量从小到大排列
+enum PDFImageFormat
+{
+	PDFImage_Bilevel,	// 1位黑白，行按字节对齐，1为黑色
+	PDFImage_Gray,		// 8位灰度
+	PDFImage_Indexed,	// 调色板，最多256色
+	PDFImage_RGB		// 24位真彩
+};
+
+// 嵌入前准备好的图片数据，不涉及libharu，可在工作线程中生成
+typedef struct PDFImageData
+{
+	PDFImageData(): Format(PDFImage_RGB), Width(0), Height(0) {}
+
+	PDFImageFormat Format;
+	int		   Width;
+	int		   Height;
+	QByteArray Samples;		// 像素数据；PDFImage_Indexed时为调色板PNG数据
+	QByteArray Alpha;		// 每像素1字节的Alpha平面，为空表示不透明
+} PDFImageData;
+
+// 超过maxSize（像素）时先重采样，再选择能无损表示图片的最小格式；maxSize无效表示不限制
+PDFImageData prepareImage(const QImage &image, const QSize &maxSize);
+
+// 在线程池中执行prepareImage，result()等待完成
+class PDFImageJob : public QRunnable
+{
+public:
+	PDFImageJob(const QImage &image, const QSize &maxSize);
+
+	void run();
+	PDFImageData result();
+
+private:
+	QImage		 m_image;
+	QSize		 m_maxSize;
+	PDFImageData m_data;
+	QSemaphore	 m_done;
+};
+
+#endif // HPDFIMAGE_H
@@ -0,0 +1,19 @@
+#ifndef HPDFSIMD_H
+#define HPDFSIMD_H
+
+/*
+Compile time selection of the vector kernels, every kernel keeps a scalar fallback.
+MSVC does not define __SSE2__, derive it from the target architecture.
+*/
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define HPDF_SIMD_AVX2
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HPDF_SIMD_SSE2
+#endif
+
+#endif // HPDFSIMD_H
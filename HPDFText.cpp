@@ -0,0 +1,303 @@
+#include "HPDFText.h"
+#include "HPDFSimd.h"
+#include <algorithm>
+
+namespace
+{
+
+// Marks an entry that has not been read from libharu yet
+const quint16 UnknownWidth = 0xffff;
+
+// Index of the first UTF-16 unit below 0x20, or -1
+int findControlChar(const ushort *text, int length)
+{
+	int i = 0;
+#if defined(HPDF_SIMD_AVX2)
+	const __m256i last = _mm256_set1_epi16(0x1f);
+	const __m256i zero = _mm256_setzero_si256();
+	for (; i + 16 <= length; i += 16)
+	{
+		// Unsigned saturation leaves 0 exactly for the units <= 0x1f
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(text + i));
+		uint mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_subs_epu16(v, last), zero));
+		if (mask)
+		{
+			return i + qCountTrailingZeroBits(mask) / 2;
+		}
+	}
+#elif defined(HPDF_SIMD_SSE2)
+	const __m128i last = _mm_set1_epi16(0x1f);
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 8 <= length; i += 8)
+	{
+		// Unsigned saturation leaves 0 exactly for the units <= 0x1f
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i));
+		uint mask = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_subs_epu16(v, last), zero));
+		if (mask)
+		{
+			return i + qCountTrailingZeroBits(mask) / 2;
+		}
+	}
+#endif
+	for (; i < length; ++i)
+	{
+		if (text[i] < 0x20)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Index of the first UTF-16 unit outside 0x00-0x7e and 0xa0-0xff, or -1
+int findNonLatin1(const ushort *text, int length)
+{
+	int i = 0;
+#if defined(HPDF_SIMD_AVX2)
+	const __m256i del = _mm256_set1_epi16(0x7f);
+	const __m256i span = _mm256_set1_epi16(0x20);
+	const __m256i high = _mm256_set1_epi16(short(0xff00));
+	const __m256i zero = _mm256_setzero_si256();
+	for (; i + 16 <= length; i += 16)
+	{
+		// 0x7f-0x9f: the wrapped difference saturates to 0, anything above 0xff has high bits
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(text + i));
+		__m256i c1 = _mm256_cmpeq_epi16(_mm256_subs_epu16(_mm256_sub_epi16(v, del), span), zero);
+		__m256i latin1 = _mm256_cmpeq_epi16(_mm256_and_si256(v, high), zero);
+		uint mask = _mm256_movemask_epi8(_mm256_or_si256(c1, _mm256_xor_si256(latin1, _mm256_cmpeq_epi16(zero, zero))));
+		if (mask)
+		{
+			return i + qCountTrailingZeroBits(mask) / 2;
+		}
+	}
+#elif defined(HPDF_SIMD_SSE2)
+	const __m128i del = _mm_set1_epi16(0x7f);
+	const __m128i span = _mm_set1_epi16(0x20);
+	const __m128i high = _mm_set1_epi16(short(0xff00));
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 8 <= length; i += 8)
+	{
+		// 0x7f-0x9f: the wrapped difference saturates to 0, anything above 0xff has high bits
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i));
+		__m128i c1 = _mm_cmpeq_epi16(_mm_subs_epu16(_mm_sub_epi16(v, del), span), zero);
+		__m128i latin1 = _mm_cmpeq_epi16(_mm_and_si128(v, high), zero);
+		uint mask = _mm_movemask_epi8(_mm_or_si128(c1, _mm_xor_si128(latin1, _mm_cmpeq_epi16(zero, zero))));
+		if (mask)
+		{
+			return i + qCountTrailingZeroBits(mask) / 2;
+		}
+	}
+#endif
+	for (; i < length; ++i)
+	{
+		if (text[i] > 0xff || (text[i] >= 0x7f && text[i] <= 0x9f))
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Characters WinAnsiEncoding places at 0x80-0x9f, sorted
+const ushort winAnsiExtra[] =
+{
+	0x0152, 0x0153, 0x0160, 0x0161, 0x0178, 0x017d, 0x017e, 0x0192, 0x02c6, 0x02dc,
+	0x2013, 0x2014, 0x2018, 0x2019, 0x201a, 0x201c, 0x201d, 0x201e, 0x2020, 0x2021,
+	0x2022, 0x2026, 0x2030, 0x2039, 0x203a, 0x20ac, 0x2122
+};
+
+}
+
+PDFWidthTable::PDFWidthTable()
+{
+	memset(m_pages, 0, sizeof(m_pages));
+	for (int i = 0; i < 128; ++i)
+	{
+		m_ascii[i] = -1;
+	}
+}
+
+PDFWidthTable::~PDFWidthTable()
+{
+	for (int i = 0; i < 256; ++i)
+	{
+		delete[] m_pages[i];
+	}
+}
+
+QSharedPointer<PDFWidthTable> PDFWidthTable::forFont(HPDF_Font font)
+{
+	static QMutex mutex;
+	static QHash<QByteArray, QSharedPointer<PDFWidthTable> > tables;
+
+	// Widths depend on the font program and, for CID fonts, on the CMap
+	QByteArray key(HPDF_Font_GetFontName(font));
+	key += '/';
+	key += HPDF_Font_GetEncodingName(font);
+
+	QMutexLocker locker(&mutex);
+	QSharedPointer<PDFWidthTable> &table = tables[key];
+	if (!table)
+	{
+		table = QSharedPointer<PDFWidthTable>(new PDFWidthTable);
+	}
+	return table;
+}
+
+int PDFWidthTable::width(HPDF_Font font, ushort code)
+{
+	quint16 *&page = m_pages[code >> 8];
+	if (!page)
+	{
+		page = new quint16[256];
+		for (int i = 0; i < 256; ++i)
+		{
+			page[i] = UnknownWidth;
+		}
+	}
+
+	// CID fonts answer by scanning the whole CMap, TrueType fonts by a cmap segment search:
+	// each code is asked only once per process
+	quint16 &entry = page[code & 0xff];
+	if (UnknownWidth == entry)
+	{
+		entry = quint16(qBound(0, int(HPDF_Font_GetUnicodeWidth(font, code)), int(UnknownWidth) - 1));
+	}
+	return entry;
+}
+
+int PDFWidthTable::asciiWidth(HPDF_Font font, ushort code)
+{
+	// Filled entry by entry: reading a TrueType width marks the glyph for the subset,
+	// so only characters that are actually used may be asked
+	int &entry = m_ascii[code];
+	if (entry < 0)
+	{
+		entry = width(font, code);
+	}
+	return entry;
+}
+
+QVector<int> PDFWidthTable::charWidths(HPDF_Font font, const QString &text)
+{
+	QVector<int> widths(text.size());
+	const ushort *code = text.utf16();
+	const int length = text.size();
+
+	QMutexLocker locker(&m_mutex);
+	// ASCII runs read the dense copy, only other characters go through the pages
+	int i = 0;
+	while (i < length)
+	{
+		const int end = i + asciiRun(code + i, length - i);
+		for (; i < end; ++i)
+		{
+			widths[i] = asciiWidth(font, code[i]);
+		}
+		if (i < length)
+		{
+			widths[i] = width(font, code[i]);
+			++i;
+		}
+	}
+	return widths;
+}
+
+double PDFWidthTable::textWidth(HPDF_Font font, const QString &text, double fontSize)
+{
+	qint64 total = 0;
+	const ushort *code = text.utf16();
+	const int length = text.size();
+
+	QMutexLocker locker(&m_mutex);
+	int i = 0;
+	while (i < length)
+	{
+		const int end = i + asciiRun(code + i, length - i);
+		for (; i < end; ++i)
+		{
+			total += asciiWidth(font, code[i]);
+		}
+		if (i < length)
+		{
+			total += width(font, code[i]);
+			++i;
+		}
+	}
+	return total * fontSize / 1000;
+}
+
+int asciiRun(const ushort *text, int length)
+{
+	int i = 0;
+#if defined(HPDF_SIMD_AVX2)
+	const __m256i high = _mm256_set1_epi16(short(0xff80));
+	const __m256i zero = _mm256_setzero_si256();
+	for (; i + 16 <= length; i += 16)
+	{
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(text + i));
+		uint mask = ~uint(_mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_and_si256(v, high), zero)));
+		if (mask)
+		{
+			return i + qCountTrailingZeroBits(mask) / 2;
+		}
+	}
+#elif defined(HPDF_SIMD_SSE2)
+	const __m128i high = _mm_set1_epi16(short(0xff80));
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 8 <= length; i += 8)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i));
+		uint mask = ~uint(_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, high), zero))) & 0xffff;
+		if (mask)
+		{
+			return i + qCountTrailingZeroBits(mask) / 2;
+		}
+	}
+#endif
+	for (; i < length && text[i] < 0x80; ++i)
+	{
+	}
+	return i;
+}
+
+QString replaceControlChars(const QString &text)
+{
+	int first = findControlChar(text.utf16(), text.size());
+	if (first < 0)
+	{
+		return text;
+	}
+
+	// Words on both sides of a line break stay apart
+	QString result = text;
+	ushort *code = reinterpret_cast<ushort *>(result.data());
+	for (int i = first; i >= 0;)
+	{
+		code[i] = ' ';
+		const int next = findControlChar(code + i + 1, result.size() - i - 1);
+		i = next < 0 ? -1 : i + 1 + next;
+	}
+	return result;
+}
+
+bool fitsWinAnsi(const QString &text)
+{
+	const ushort *code = text.utf16();
+	const ushort *extraEnd = winAnsiExtra + sizeof(winAnsiExtra) / sizeof(winAnsiExtra[0]);
+	int i = 0;
+	for (;;)
+	{
+		const int found = findNonLatin1(code + i, text.size() - i);
+		if (found < 0)
+		{
+			return true;
+		}
+		i += found;
+		if (!std::binary_search(winAnsiExtra, extraEnd, code[i]))
+		{
+			return false;
+		}
+		++i;
+	}
+}
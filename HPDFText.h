@@ -0,0 +1,44 @@
+﻿#ifndef HPDFTEXT_H
+#define HPDFTEXT_H
+
+#include <QtCore>
+#include "./include/hpdf.h"
+
+// 字体的字宽缓存：按Unicode分两级256页，页在首次使用时分配，字宽按需从libharu读取
+// 同名字体、同一编码的表在进程内共享，可跨文档、跨线程使用
+class PDFWidthTable
+{
+public:
+	~PDFWidthTable();
+
+	// 获取font对应的共享字宽表
+	static QSharedPointer<PDFWidthTable> forFont(HPDF_Font font);
+
+	// 每个字符的字宽，单位为1/1000字号；font用于读取尚未缓存的字宽
+	QVector<int> charWidths(HPDF_Font font, const QString &text);
+
+	// 与HPDF_Page_TextWidth相同（字距、词距为0时）
+	double textWidth(HPDF_Font font, const QString &text, double fontSize);
+
+private:
+	PDFWidthTable();
+	Q_DISABLE_COPY(PDFWidthTable)
+
+	int width(HPDF_Font font, ushort code);
+	int asciiWidth(HPDF_Font font, ushort code);
+
+	QMutex	 m_mutex;
+	quint16 *m_pages[256];
+	int		 m_ascii[128];		// ASCII字宽的连续副本，用于快速路径；-1为尚未读取
+};
+
+// 从text开始的连续ASCII字符数
+int asciiRun(const ushort *text, int length);
+
+// 换行等控制字符替换为空格（没有字形，输出为乱码）；不含控制字符时直接返回text，不复制
+QString replaceControlChars(const QString &text);
+
+// 全部字符都能用WinAnsiEncoding表示（标准14字体可直接显示），控制字符除外
+bool fitsWinAnsi(const QString &text);
+
+#endif // HPDFTEXT_H
@@ -75,6 +75,52 @@ std::string GetSystemFontFile(const std::wstring &faceName)
 	return std::string(wsFontFile.begin(), wsFontFile.end());
 }
 
+// Get system font file path, the registry is scanned once per face name and process
+std::string GetCachedSystemFontFile(const std::wstring &faceName)
+{
+	static QMutex mutex;
+	static QHash<QString, QByteArray> cache;
+
+	const QString key = QString::fromStdWString(faceName);
+	QMutexLocker locker(&mutex);
+	QHash<QString, QByteArray>::const_iterator it = cache.constFind(key);
+	if (it == cache.constEnd())
+	{
+		it = cache.insert(key, QByteArray(GetSystemFontFile(faceName).c_str()));
+	}
+	return it.value().constData();
+}
+
+// Get a path fopen() can open for an existing file, empty if the ANSI code page cannot express it
+std::string GetNativeFilePath(const QString &path)
+{
+	QString nativePath = QDir::toNativeSeparators(path);
+	QTextCodec *codec = QTextCodec::codecForLocale();
+	if (codec->canEncode(nativePath))
+	{
+		return nativePath.toLocal8Bit().constData();
+	}
+
+	// 8.3 short names are plain ASCII, unless they are disabled on the volume
+	std::wstring wsPath = nativePath.toStdWString();
+	DWORD length = GetShortPathNameW(wsPath.c_str(), NULL, 0);
+	if (0 == length)
+	{
+		return "";
+	}
+	std::vector<WCHAR> shortPath(length);
+	if (0 == GetShortPathNameW(wsPath.c_str(), &shortPath[0], length))
+	{
+		return "";
+	}
+	nativePath = QString::fromWCharArray(&shortPath[0]);
+	if (!codec->canEncode(nativePath))
+	{
+		return "";
+	}
+	return nativePath.toLocal8Bit().constData();
+}
+
 bool ends_with(std::string const & value, std::string const & ending)
 {
 	if (ending.size() > value.size()) return false;
@@ -91,13 +137,127 @@ void error_handler(HPDF_STATUS error_no, HPDF_STATUS detail_no, void *)
 	longjmp(env, 1);
 }
 
+// libharu handles are recycled across documents: HPDF_FreeDoc keeps the encoders and font
+// definitions registered on a handle, so the CMap tables are built once per handle instead
+// of once per report. Registering twice on a handle is an error, hence the bookkeeping.
+// Only handles without an embedded TrueType definition go back to the pool: such a definition
+// keeps the used-glyph flags of every report, so later subsets would grow with the pool history
+// and reveal the characters of unrelated reports.
+// An idle handle retains the CMap tables and the CNS font definitions, up to idealThreadCount()
+// handles, until HPDFWriter::releaseCachedDocuments() frees them.
+enum PDFDocResource
+{
+	Resource_UTFEncodings = 0x1,
+	Resource_CNSEncodings = 0x2,
+	Resource_CNSFonts	  = 0x4,
+	Resource_TrueTypeFont = 0x8		// a TrueType file was loaded, the handle is not reusable
+};
+
+QMutex				  docMutex;
+QList<HPDF_Doc>		  idleDocs;
+QHash<HPDF_Doc, uint> docResources;
+
+HPDF_Doc AcquirePDFDoc()
+{
+	QMutexLocker locker(&docMutex);
+	if (!idleDocs.isEmpty())
+	{
+		HPDF_Doc pdf = idleDocs.takeLast();
+		locker.unlock();
+		HPDF_NewDoc(pdf);
+		return pdf;
+	}
+	locker.unlock();
+	return HPDF_New(error_handler, NULL);
+}
+
+void FreePDFDoc(HPDF_Doc pdf)
+{
+	QMutexLocker locker(&docMutex);
+	docResources.remove(pdf);
+	locker.unlock();
+	HPDF_Free(pdf);
+}
+
+void ReleasePDFDoc(HPDF_Doc pdf)
+{
+	// Keep about one idle handle per thread that may write reports concurrently
+	HPDF_FreeDoc(pdf);
+	QMutexLocker locker(&docMutex);
+	if (!(docResources.value(pdf) & Resource_TrueTypeFont) && idleDocs.size() < QThread::idealThreadCount())
+	{
+		idleDocs.append(pdf);
+		return;
+	}
+	locker.unlock();
+	FreePDFDoc(pdf);
+}
+
+void HPDFWriter::releaseCachedDocuments()
+{
+	QMutexLocker locker(&docMutex);
+	QList<HPDF_Doc> docs;
+	docs.swap(idleDocs);
+	locker.unlock();
+
+	foreach(HPDF_Doc pdf, docs)
+	{
+		FreePDFDoc(pdf);
+	}
+}
+
+// Registers the resources the handle does not have yet
+void UsePDFResources(HPDF_Doc pdf, uint resources)
+{
+	QMutexLocker locker(&docMutex);
+	uint missing = resources & ~docResources.value(pdf);
+	locker.unlock();
+
+	if (missing & Resource_UTFEncodings)
+	{
+		HPDF_UseUTFEncodings(pdf);
+	}
+	if (missing & Resource_CNSFonts)
+	{
+		HPDF_UseCNSFonts(pdf);
+	}
+	if (missing & Resource_CNSEncodings)
+	{
+		HPDF_UseCNSEncodings(pdf);
+	}
+
+	locker.relock();
+	docResources[pdf] |= missing;
+}
+
+// Loads a TrueType font file, index selects a font of a collection (-1 for .ttf).
+// The handle keeps the definition's used-glyph flags afterwards and is no longer pooled.
+std::string LoadPDFFontFile(HPDF_Doc pdf, const std::string &fPath, int index)
+{
+	QMutexLocker locker(&docMutex);
+	docResources[pdf] |= Resource_TrueTypeFont;
+	locker.unlock();
+
+	const char *loaded = index < 0 ? HPDF_LoadTTFontFromFile(pdf, fPath.c_str(), HPDF_TRUE)
+		: HPDF_LoadTTFontFromFile2(pdf, fPath.c_str(), index, HPDF_TRUE);
+	return loaded ? loaded : "";
+}
+
 // Optional：https://github.com/libharu/libharu/wiki/Encodings
 void HPDFWriter::initPDFFont()
 {
-	string codecName = "UTF-8";
-	m_codecName = codecName;
-	HPDF_UseUTFEncodings(m_pdf);
-	
+	// Bookmarks are always UTF-8, the page font is chosen by selectFont() once the content is known
+	UsePDFResources(m_pdf, Resource_UTFEncodings);
+	m_encoder = HPDF_GetEncoder(m_pdf, "UTF-8");
+	m_codec = NULL;
+	m_font = NULL;
+}
+
+void HPDFWriter::loadSystemFont()
+{
+	m_encName = "UTF-8";
+	m_codecName = m_encName;
+
 	// Get System Default Font
 	// NONCLIENTMETRICS im;
 	// im.cbSize = sizeof(NONCLIENTMETRICS);
@@ -105,7 +265,7 @@ void HPDFWriter::initPDFFont()
 	
 	LOGFONT lf;
 	::GetObject(::GetStockObject(DEFAULT_GUI_FONT), sizeof(lf), &lf);
-	std::string fPath = GetSystemFontFile(lf.lfFaceName);
+	std::string fPath = GetCachedSystemFontFile(lf.lfFaceName);
 
 	m_fName.clear();
 	if (!fPath.empty())
@@ -115,11 +275,11 @@ void HPDFWriter::initPDFFont()
 		const std::string sttc(".ttc");
 		if (ends_with(fPath, sttf))		// ttf font
 		{
-			m_fName = HPDF_LoadTTFontFromFile(m_pdf, fPath.c_str(), HPDF_TRUE);
+			m_fName = LoadPDFFontFile(m_pdf, fPath, -1);
 		}
 		else if (ends_with(fPath, sttc))	// ttc font
 		{
-			m_fName = HPDF_LoadTTFontFromFile2(m_pdf, fPath.c_str(), 0, HPDF_TRUE);	// get firt font
+			m_fName = LoadPDFFontFile(m_pdf, fPath, 0);	// get firt font
 		}
 	}
 	if (m_fName.empty())
@@ -127,20 +287,104 @@ void HPDFWriter::initPDFFont()
 #ifndef ZHCN
 		// set SimSun
 		m_fName = "SimSun";
-		codecName = "GBK-EUC-H";
+		m_encName = "GBK-EUC-H";
 		m_codecName = "GB18030";
 
-		HPDF_UseCNSFonts(m_pdf);
-		HPDF_UseCNSEncodings(m_pdf);
+		UsePDFResources(m_pdf, Resource_CNSFonts | Resource_CNSEncodings);
 #else
 		// set local font
-		m_fName = HPDF_LoadTTFontFromFile(m_pdf, QString(qApp->applicationDirPath() + "/fonts/segoeui.ttf").toLocal8Bit().constData(), HPDF_TRUE);
+		m_fName = LoadPDFFontFile(m_pdf, QString(qApp->applicationDirPath() + "/fonts/segoeui.ttf").toLocal8Bit().constData(), -1);
 #endif
 	}
+}
+
+// libharu single-byte encoders and the matching Qt codecs, most common first
+static const char *const singleByteEncodings[][2] =
+{
+	{"CP1252", "windows-1252"},
+	{"CP1250", "windows-1250"},
+	{"CP1251", "windows-1251"},
+	{"CP1253", "windows-1253"},
+	{"CP1254", "windows-1254"},
+	{"CP1257", "windows-1257"}
+};
+
+void HPDFWriter::selectFont()
+{
+	// Text that fits WinAnsi needs no font file at all: a standard 14 font is built into every viewer
+	QTextCodec *winAnsi = m_pro.standardFont ? QTextCodec::codecForName("windows-1252") : NULL;
+	if (winAnsi && fitsWinAnsi())
+	{
+		m_codec = winAnsi;
+		HPDF_SetCurrentEncoder(m_pdf, "WinAnsiEncoding");
+		m_font = HPDF_GetFont(m_pdf, "Helvetica", "WinAnsiEncoding");
+		m_widths = PDFWidthTable::forFont(m_font);
+		return;
+	}
+
+	// The font object is created once the content is known, an unused one would still be written
+	loadSystemFont();
+	std::string encName = m_encName;
+	// UTF-8 is produced by QString itself, a codec is only needed for the CNS encodings
+	m_codec = "UTF-8" == m_codecName ? NULL : QTextCodec::codecForName(m_codecName.c_str());
+
+	// An embedded TrueType font whose text fits one code page is written as a simple font:
+	// one byte per character in the content streams instead of a 2-byte CID
+	if (m_pro.singleByteFont && "UTF-8" == encName)
+	{
+		for (size_t i = 0; i < sizeof(singleByteEncodings) / sizeof(singleByteEncodings[0]); ++i)
+		{
+			QTextCodec *codec = QTextCodec::codecForName(singleByteEncodings[i][1]);
+			if (codec && canEncode(codec))
+			{
+				encName = singleByteEncodings[i][0];
+				m_codec = codec;
+				break;
+			}
+		}
+	}
+
+	HPDF_SetCurrentEncoder(m_pdf, encName.c_str());
+	m_font = HPDF_GetFont(m_pdf, m_fName.c_str(), encName.c_str());
+	m_widths = PDFWidthTable::forFont(m_font);
+}
+
+bool HPDFWriter::fitsWinAnsi() const
+{
+	foreach(const PDFItem &item, m_mContent)
+	{
+		if (!::fitsWinAnsi(item.Title.Text))
+		{
+			return false;
+		}
+		foreach(const PDFString &section, item.Sections)
+		{
+			if (!::fitsWinAnsi(section.Text))
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
 
-	HPDF_SetCurrentEncoder(m_pdf, codecName.c_str());
-	m_encoder = HPDF_GetEncoder(m_pdf, codecName.c_str());
-	m_font = HPDF_GetFont(m_pdf, m_fName.c_str(), codecName.c_str());
+bool HPDFWriter::canEncode(QTextCodec *codec) const
+{
+	foreach(const PDFItem &item, m_mContent)
+	{
+		if (!codec->canEncode(item.Title.Text))
+		{
+			return false;
+		}
+		foreach(const PDFString &section, item.Sections)
+		{
+			if (!codec->canEncode(section.Text))
+			{
+				return false;
+			}
+		}
+	}
+	return true;
 }
 
 void HPDFWriter::saveToPDF(const QString& path)
@@ -148,8 +392,23 @@ void HPDFWriter::saveToPDF(const QString& path)
 	HPDF_Outline root;
 	HPDF_Destination dst;
 
+	/* Start image work in the background */
+	prepareImages();
+
+	/* Pick the font encoding that fits the content */
+	selectFont();
+
+	/* Size the page tree before the first page exists */
+	int pages = estimatePages();
+	if (pages > 256)
+	{
+		// Two-level tree: only the /Kids arrays are bounded, the root's no longer lists every page.
+		// HPDF_AddPage still appends each page to libharu's page list and xref list, that growth is unchanged.
+		HPDF_SetPagesConfiguration(m_pdf, qCeil(qSqrt(pages)));
+	}
+
 	/* Create bookmark */
-	root = HPDF_CreateOutline(m_pdf, NULL, toLang(tr("Bookmark")).c_str(), m_encoder);
+	root = HPDF_CreateOutline(m_pdf, NULL, toOutline(tr("Bookmark")).constData(), m_encoder);
 	HPDF_Outline_SetOpened(root, HPDF_TRUE);
 
 	int topSpace = m_pro.yedge;
@@ -163,35 +422,47 @@ void HPDFWriter::saveToPDF(const QString& path)
 		HPDF_Page_SetHeight(page, m_szPage.height());
 
 		/* Create bookmarks */
-		HPDF_Outline outline = HPDF_CreateOutline(m_pdf, root, toLang(item.Title.Text).c_str(), m_encoder);
+		HPDF_Outline outline = HPDF_CreateOutline(m_pdf, root, toOutline(item.Title.Text).constData(), m_encoder);
 		dst = HPDF_Page_CreateDestination(page);
 		HPDF_Destination_SetXYZ(dst, 0, HPDF_Page_GetHeight(page), 1);
 		HPDF_Outline_SetDestination(outline, dst);
 
-		/* Begin text content */
-		HPDF_Page_BeginText(page);
-
 		/* Set page property：print title */
-		HPDF_Page_SetFontAndSize(page, m_font, m_pro.titleSize);
+		setFontAndSize(page, m_pro.titleSize);
 		// Left bottom pos
 		topSpace = m_pro.yedge + m_pro.titleSize;
-		HPDF_Page_TextOutEx(page, m_pro.xedge, m_szPage.height() - topSpace, item.Title.Align, toLang(item.Title.Text).c_str());
+		HPDF_Page_TextOutEx(page, m_pro.xedge, m_szPage.height() - topSpace, item.Title.Align, replaceControlChars(item.Title.Text));
 		topSpace += m_pro.titleSpace + m_pro.contentSize;
 
 		/* Set page property：print content */
-		QFont qfont(m_fName.c_str(), m_pro.contentSize);		// Font for  paragraph
-		HPDF_Page_SetFontAndSize(page, m_font, m_pro.contentSize);
+		setFontAndSize(page, m_pro.contentSize);
 		bool mine = true;
 		// Print  paragraph
 		for (int cntContent = 0; cntContent < item.Sections.size(); ++cntContent)
 		{
 			// Print  paragraph：split into lines and print
 			PDFString sContent = item.Sections.at(cntContent);
-			QList<QString> lines = wrapString(sContent.Text, qfont, m_wContent, 10);
+			if (!sContent.Image.isNull())
+			{
+				page = drawImage(page, sContent, topSpace);
+				// drawImage leaves topSpace at the image bottom, a caption starts one full line below
+				if (!sContent.Text.isEmpty())
+				{
+					topSpace += m_pro.contentSize + m_pro.lineSpace;
+					/* Out of page */
+					if (topSpace >= m_szPage.height() - m_pro.yedge)
+					{
+						page = nextPage(page);
+						topSpace = m_pro.yedge + m_pro.contentSize;
+					}
+				}
+			}
+			// No line break or other control character, they have no glyph and would be garbled
+			QList<QString> lines = wrapString(replaceControlChars(sContent.Text), m_pro.contentSize, m_wContent / ratio(), 10);
 			width = contentWidth(page, lines);
 			for (int cntLine = 0; cntLine < lines.size(); ++cntLine)
 			{
-				HPDF_Page_TextOutEx(page, m_pro.xedge, m_szPage.height() - topSpace, sContent.Align, toLang(lines.at(cntLine)).c_str(), width);
+				HPDF_Page_TextOutEx(page, m_pro.xedge, m_szPage.height() - topSpace, sContent.Align, lines.at(cntLine), width);
 
 				// Not last line
 				if (cntLine < lines.size() - 1)
@@ -201,17 +472,7 @@ void HPDFWriter::saveToPDF(const QString& path)
 					/* Out of page */
 					if (topSpace >= m_szPage.height() - m_pro.yedge)
 					{
-						/* End current page */
-						HPDF_Page_EndText(page);
-
-						page = HPDF_AddPage(m_pdf);
-						HPDF_Page_SetWidth(page, m_szPage.width());
-						HPDF_Page_SetHeight(page, m_szPage.height());
-
-						/* Begin new page */
-						HPDF_Page_SetFontAndSize(page, m_font, m_pro.contentSize);
-						HPDF_Page_BeginText(page);
-
+						page = nextPage(page);
 						topSpace = m_pro.yedge + m_pro.contentSize;
 					}
 				}
@@ -223,23 +484,13 @@ void HPDFWriter::saveToPDF(const QString& path)
 			/* Out of page */
 			if (topSpace >= m_szPage.height() - m_pro.yedge)
 			{
-				/* End current page */
-				HPDF_Page_EndText(page);
-
-				page = HPDF_AddPage(m_pdf);
-				HPDF_Page_SetWidth(page, m_szPage.width());
-				HPDF_Page_SetHeight(page, m_szPage.height());
-
-				/* Begin new page */
-				HPDF_Page_BeginText(page);
-				HPDF_Page_SetFontAndSize(page, m_font, m_pro.contentSize);
-
+				page = nextPage(page);
 				topSpace = m_pro.yedge + m_pro.contentSize;
 			}
 		}
 
 		/* End current page */
-		HPDF_Page_EndText(page);
+		endText(page);
 	}
 
 	/* Save to PDF to file*/
@@ -248,23 +499,42 @@ void HPDFWriter::saveToPDF(const QString& path)
 	QFile file(path);
 	if (file.open(QIODevice::WriteOnly))
 	{
-		HPDF_SaveToStream(m_pdf);
-		/* get the data from the stream and output it to stdout. */
-		for (;;)
+		// libharu writes straight into the file when it can open the path itself,
+		// instead of building the whole document in a memory stream first
+		file.close();
+		std::string fPath = GetNativeFilePath(path);
+		if (!fPath.empty())
 		{
-			HPDF_BYTE buf[4096];
-			HPDF_UINT32 siz = 4096;
-			
-			HPDF_ReadFromStream(m_pdf, buf, &siz);
-			if (siz == 0)
+			// I/O errors must not reach error_handler: its longjmp target in initPDF has returned
+			HPDF_SetErrorHandler(m_pdf, NULL);
+			if (HPDF_OK != HPDF_SaveToFile(m_pdf, fPath.c_str()))
 			{
-				break;
+				qDebug() << "Message save as PDF error";
+				HPDF_ResetError(m_pdf);
+				m_ret = -2;
 			}
-
-			if (-1 == file.write(reinterpret_cast<const char *>(buf), siz))
+			HPDF_SetErrorHandler(m_pdf, error_handler);
+		}
+		else if (file.open(QIODevice::WriteOnly))
+		{
+			HPDF_SaveToStream(m_pdf);
+			/* get the data from the stream and output it to the file in large blocks */
+			QByteArray buf(qMin<HPDF_UINT32>(HPDF_GetStreamSize(m_pdf), 1024 * 1024) + 1, Qt::Uninitialized);
+			for (;;)
 			{
-				qDebug() << "Message save as PDF error";
-				break;
+				HPDF_UINT32 siz = buf.size();
+
+				HPDF_ReadFromStream(m_pdf, reinterpret_cast<HPDF_BYTE *>(buf.data()), &siz);
+				if (siz == 0)
+				{
+					break;
+				}
+
+				if (-1 == file.write(buf.constData(), siz))
+				{
+					qDebug() << "Message save as PDF error";
+					break;
+				}
 			}
 		}
 	}
@@ -273,13 +543,19 @@ void HPDFWriter::saveToPDF(const QString& path)
 		m_ret = -2;
 	}
 	/* Clean up*/
-	HPDF_Free(m_pdf);
+	m_pool.waitForDone();
+	m_jobs.clear();
+	if (m_pdf)
+	{
+		ReleasePDFDoc(m_pdf);
+		m_pdf = NULL;
+	}
 }
 
 void HPDFWriter::initPDF()
 {
 	m_ret = -1;
-	m_pdf = HPDF_New(error_handler, NULL);
+	m_pdf = AcquirePDFDoc();
 	if (!m_pdf)
 	{
 		printf("error: cannot create PdfDoc object\n");
@@ -288,59 +564,106 @@ void HPDFWriter::initPDF()
 
 	if (setjmp(env))
 	{
-		HPDF_Free(m_pdf);
+		FreePDFDoc(m_pdf);
+		m_pdf = NULL;
 	}
 	else
 	{
 		/* Set page mode to use outlines */
 		HPDF_SetPageMode(m_pdf, HPDF_PAGE_MODE_USE_OUTLINE);
+		/* Deflate embedded image samples */
+		HPDF_SetCompressionMode(m_pdf, HPDF_COMP_IMAGE);
 		m_ret = 0;
 	}
 }
 
-std::string HPDFWriter::toLang(const QString& text) const
+QByteArray HPDFWriter::toLang(const QString& text) const
 {
-	QTextCodec *codec = QTextCodec::codecForName(m_codecName.c_str());
-	return codec->fromUnicode(text).constData();
+	// Straight from UTF-16: no codec state, no extra std::string copy per line
+	if (!m_codec)
+	{
+		return text.toUtf8();
+	}
+	// GB18030 keeps ASCII as is, pure ASCII lines skip the codec
+	if (asciiRun(text.utf16(), text.size()) == text.size())
+	{
+		return text.toLatin1();
+	}
+	return m_codec->fromUnicode(text);
 }
 
-int HPDFWriter::contentWidth(const HPDF_Page page, const QList<QString> &lines) const
+QByteArray HPDFWriter::toOutline(const QString& text) const
+{
+	// Bookmarks use the UTF-8 encoder set up by initPDFFont, whatever the page font is
+	return text.toUtf8();
+}
+
+int HPDFWriter::contentWidth(const HPDF_Page page, const QList<QString> &lines)
 {
 	int width = 0;
+	HPDF_REAL fontSize = HPDF_Page_GetCurrentFontSize(page);
 	foreach(const QString &line, lines)
 	{
-		width = qMax(width, (int)HPDF_Page_TextWidth(page, toLang(line).c_str()));
+		width = qMax(width, (int)m_widths->textWidth(m_font, line, fontSize));
 	}
 	return  width;
 }
 
-void HPDFWriter::HPDF_Page_TextOutEx(HPDF_Page page, int edge, int ypos, PDFTextAlign align, const char *text, int width)
+void HPDFWriter::HPDF_Page_TextOutEx(HPDF_Page page, int edge, int ypos, PDFTextAlign align, const QString &text, int width)
 {
 	int pageWidth = HPDF_Page_GetWidth(page);
 
+	double textWidth = width;
 	if (0 == width && PDFAlign_Left != align)
 	{
-		width = HPDF_Page_TextWidth(page, text);
+		textWidth = m_widths->textWidth(m_font, text, HPDF_Page_GetCurrentFontSize(page));
 	}
-	int xpos = edge;
+	// Positions are snapped by pdfReal like image coordinates, centred text keeps its half points
+	HPDF_REAL xpos = pdfReal(edge);
 	if (PDFAlign_Center == align)
 	{
-		xpos = (pageWidth - width) / 2;
+		xpos = pdfReal((pageWidth - textWidth) / 2);
 	}
 	else if (PDFAlign_Right == align)
 	{
-		xpos = pageWidth - width - edge;
+		xpos = pdfReal(pageWidth - textWidth - edge);
+	}
+	const HPDF_REAL baseline = pdfReal(ypos);
+	// Control characters were replaced by the caller, before the text was wrapped and measured
+	if (text.isEmpty())
+	{
+		return;
+	}
+
+	if (HPDF_GMODE_TEXT_OBJECT != HPDF_Page_GetGMode(page))
+	{
+		HPDF_Page_BeginText(page);
+	}
+
+	// A line straight below the previous one is shown with ' and the text leading: no Td operands.
+	// The text matrix holds the start of the previous line, BT resets it. Both ends are
+	// multiples of the pdfReal step, so the difference and the leading are exact as well.
+	const HPDF_TransMatrix matrix = HPDF_Page_GetTextMatrix(page);
+	const HPDF_REAL leading = matrix.y - baseline;
+	if (matrix.x == xpos && leading > 0)
+	{
+		if (HPDF_Page_GetTextLeading(page) != leading)
+		{
+			HPDF_Page_SetTextLeading(page, leading);
+		}
+		HPDF_Page_ShowTextNextLine(page, toLang(text).constData());
 	}
-	// No line break. May be garbled
-	if (!QRegExp("[\r\n]").exactMatch(text))
+	else
 	{
-		HPDF_Page_TextOut(page, xpos, ypos, text);
+		HPDF_Page_TextOut(page, xpos, baseline, toLang(text).constData());
 	}
 }
 
-QList<QString> HPDFWriter::wrapString(const QString& text, const QFont& font, int width, int minWord)
+QList<QString> HPDFWriter::wrapString(const QString& text, double fontSize, double width, int minWord)
 {
-	QFontMetrics metrics(font);
+	// Measured with the PDF font itself: one table load per character, in 1/1000 of the font size
+	const QVector<int> advances = m_widths->charWidths(m_font, text);
+	const double limit = width * 1000 / fontSize;
 	QList<QString> lText;
 	int pos = 0;
 	int n = minWord;
@@ -352,8 +675,14 @@ QList<QString> HPDFWriter::wrapString(const QString& text, const QFont& font, in
 			n = text.size() - pos;
 			break;
 		}
-		while (metrics.width(text.mid(pos, n)) < width)
+		qint64 lineWidth = 0;
+		for (int i = pos; i < pos + n; ++i)
 		{
+			lineWidth += advances.at(i);
+		}
+		while (lineWidth < limit)
+		{
+			lineWidth += advances.at(pos + n);
 			++n;
 			if (pos + n >= text.size())
 			{
@@ -369,3 +698,208 @@ QList<QString> HPDFWriter::wrapString(const QString& text, const QFont& font, in
 	}
 	return  lText;
 }
+
+HPDF_Page HPDFWriter::nextPage(HPDF_Page page)
+{
+	/* End current page */
+	endText(page);
+
+	page = HPDF_AddPage(m_pdf);
+	HPDF_Page_SetWidth(page, m_szPage.width());
+	HPDF_Page_SetHeight(page, m_szPage.height());
+
+	/* Begin new page, the text object is opened by the first line */
+	setFontAndSize(page, m_pro.contentSize);
+	return page;
+}
+
+void HPDFWriter::endText(HPDF_Page page)
+{
+	// BT is written lazily by the first line, a page or image without text leaves no empty BT/ET pair
+	if (HPDF_GMODE_TEXT_OBJECT == HPDF_Page_GetGMode(page))
+	{
+		HPDF_Page_EndText(page);
+	}
+}
+
+void HPDFWriter::setFontAndSize(HPDF_Page page, HPDF_REAL size)
+{
+	// libharu keeps the page's graphics state but writes Tf on every call, even when nothing changes.
+	// The text state survives ET/BT, only a new page starts without a font.
+	if (HPDF_Page_GetCurrentFont(page) == m_font && HPDF_Page_GetCurrentFontSize(page) == size)
+	{
+		return;
+	}
+	HPDF_Page_SetFontAndSize(page, m_font, size);
+}
+
+HPDF_Image HPDFWriter::loadImage(const QImage &image)
+{
+	// The same QImage pasted into several sections is embedded only once
+	QHash<qint64, HPDF_Image>::const_iterator it = m_images.constFind(image.cacheKey());
+	if (it != m_images.constEnd())
+	{
+		return it.value();
+	}
+
+	// Pixel work was done by a worker thread started in prepareImages(), only libharu is called here
+	QSharedPointer<PDFImageJob> job = m_jobs.take(image.cacheKey());
+	const PDFImageData data = job ? job->result() : prepareImage(image, QSize());
+	const HPDF_BYTE *samples = reinterpret_cast<const HPDF_BYTE *>(data.Samples.constData());
+	HPDF_Image pdfImage = NULL;
+	switch (data.Format)
+	{
+	case PDFImage_Bilevel:
+		// CCITT G4 encoded by libharu
+		pdfImage = HPDF_Image_LoadRaw1BitImageFromMem(m_pdf, samples, data.Width, data.Height,
+			(data.Width + 7) / 8, HPDF_FALSE, HPDF_TRUE);
+		break;
+	case PDFImage_Gray:
+		pdfImage = HPDF_LoadRawImageFromMem(m_pdf, samples, data.Width, data.Height, HPDF_CS_DEVICE_GRAY, 8);
+		break;
+	case PDFImage_Indexed:
+		// libharu keeps the palette of a PNG as an /Indexed colour space
+		pdfImage = HPDF_LoadPngImageFromMem(m_pdf, samples, data.Samples.size());
+		break;
+	default:
+		pdfImage = HPDF_LoadRawImageFromMem(m_pdf, samples, data.Width, data.Height, HPDF_CS_DEVICE_RGB, 8);
+		break;
+	}
+
+	// The alpha plane becomes a soft mask
+	if (!data.Alpha.isEmpty())
+	{
+		HPDF_Image smask = HPDF_LoadRawImageFromMem(m_pdf, reinterpret_cast<const HPDF_BYTE *>(data.Alpha.constData()),
+			data.Width, data.Height, HPDF_CS_DEVICE_GRAY, 8);
+		HPDF_Image_AddSMask(pdfImage, smask);
+	}
+	m_images.insert(image.cacheKey(), pdfImage);
+	return pdfImage;
+}
+
+void HPDFWriter::prepareImages()
+{
+	// Largest pixel size each image needs at the configured resolution, an invalid size means no limit
+	QHash<qint64, QPair<QImage, QSize> > images;
+	foreach(const PDFItem &item, m_mContent)
+	{
+		foreach(const PDFString &section, item.Sections)
+		{
+			if (section.Image.isNull())
+			{
+				continue;
+			}
+
+			QSize limit;
+			if (m_pro.imageDpi > 0)
+			{
+				QSizeF size = imageSize(section);
+				limit = QSize(qCeil(size.width() * m_pro.imageDpi / 72), qCeil(size.height() * m_pro.imageDpi / 72));
+			}
+
+			const qint64 key = section.Image.cacheKey();
+			if (images.contains(key))
+			{
+				QSize &other = images[key].second;
+				other = other.isValid() && limit.isValid() ? other.expandedTo(limit) : QSize();
+			}
+			else
+			{
+				images.insert(key, qMakePair(section.Image, limit));
+			}
+		}
+	}
+
+	// Resampling and encoding run while the pages are laid out
+	for (QHash<qint64, QPair<QImage, QSize> >::const_iterator it = images.constBegin(); it != images.constEnd(); ++it)
+	{
+		QSharedPointer<PDFImageJob> job(new PDFImageJob(it.value().first, it.value().second));
+		m_jobs.insert(it.key(), job);
+		m_pool.start(job.data());
+	}
+}
+
+HPDF_REAL HPDFWriter::pdfReal(double value) const
+{
+	// libharu prints a real with five decimals of its float value, so 0.01 steps come out as
+	// noise like 356.67001. Steps of 1/2^coordStepBits pt are exact in a float and print with
+	// at most coordStepBits decimals; finer steps would not fit the five printed decimals.
+	const double scale = 1 << qBound(0, m_pro.coordStepBits, 5);
+	return HPDF_REAL(qRound(value * scale) / scale);
+}
+
+int HPDFWriter::estimatePages() const
+{
+	// Every item starts a page, text is assumed to average half an em per character
+	const int lineHeight = m_pro.contentSize + m_pro.lineSpace;
+	const int linesPerPage = qMax(1, (m_szPage.height() - 2 * m_pro.yedge) / lineHeight);
+	// Lines are as wide as wrapString makes them, not as wide as the page
+	const int charsPerLine = qMax(1, int(2 * (m_wContent / ratio()) / qMax(1, m_pro.contentSize)));
+
+	int pages = 0;
+	foreach(const PDFItem &item, m_mContent)
+	{
+		qint64 chars = 0;
+		foreach(const PDFString &section, item.Sections)
+		{
+			chars += section.Text.size();
+		}
+		pages += 1 + int(chars / charsPerLine / linesPerPage);
+	}
+	return pages;
+}
+
+QSizeF HPDFWriter::imageSize(const PDFString &section) const
+{
+	QSizeF size = section.ImageSize;
+	if (size.isEmpty())
+	{
+		// Natural size from the image resolution, QImage defaults to 96 dpi
+		const QImage &image = section.Image;
+		double dpiX = image.dotsPerMeterX() > 0 ? image.dotsPerMeterX() * 0.0254 : 96;
+		double dpiY = image.dotsPerMeterY() > 0 ? image.dotsPerMeterY() * 0.0254 : 96;
+		size = QSizeF(image.width() * 72 / dpiX, image.height() * 72 / dpiY);
+	}
+
+	// Never overflow the printable area of a page
+	QSizeF area(m_szPage.width() - 2 * m_pro.xedge, m_szPage.height() - 2 * m_pro.yedge);
+	if (size.width() > area.width() || size.height() > area.height())
+	{
+		size.scale(area, Qt::KeepAspectRatio);
+	}
+	return size;
+}
+
+HPDF_Page HPDFWriter::drawImage(HPDF_Page page, const PDFString &section, int &topSpace)
+{
+	QSizeF size = imageSize(section);
+	HPDF_Image image = loadImage(section.Image);
+
+	// topSpace is the baseline of the next line, the image starts at the top of that line
+	int top = topSpace - m_pro.contentSize;
+	if (top + size.height() > m_szPage.height() - m_pro.yedge && top > m_pro.yedge)
+	{
+		page = nextPage(page);
+		top = m_pro.yedge;
+	}
+
+	int pageWidth = HPDF_Page_GetWidth(page);
+	double xpos = m_pro.xedge;
+	if (PDFAlign_Center == section.Align)
+	{
+		xpos = (pageWidth - size.width()) / 2;
+	}
+	else if (PDFAlign_Right == section.Align)
+	{
+		xpos = pageWidth - size.width() - m_pro.xedge;
+	}
+
+	// Images can only be painted outside of a text object, the next line opens a new one
+	endText(page);
+	HPDF_Page_DrawImage(page, image, pdfReal(xpos), pdfReal(m_szPage.height() - top - size.height()),
+		pdfReal(size.width()), pdfReal(size.height()));
+
+	// topSpace is now the image bottom, the same place the baseline of a last line would be
+	topSpace = top + qCeil(size.height());
+	return page;
+}
@@ -9,6 +9,8 @@ https://github.com/libharu/libharu/wiki
 #include <QtCore>
 #include <QtGui>
 #include "./include/hpdf.h"
+#include "HPDFImage.h"
+#include "HPDFText.h"
 
 enum PDFTextAlign
 {
@@ -29,6 +31,10 @@ typedef struct PDFProperty
 		sectionSpace = 10;
 		xedge		 = 30;
 		yedge		 = 30;
+		imageDpi	 = 150;
+		coordStepBits = 2;
+		singleByteFont = 1;
+		standardFont = 1;
 	}
 	int titleSize;		// 标题字体大小
 	int contentSize;	// 内容字体大小
@@ -38,6 +44,10 @@ typedef struct PDFProperty
 	int sectionSpace;	// 段间距
 	int xedge;			// 页左右边距
 	int yedge;			// 页上下边距
+	int imageDpi;		// 图片最大有效分辨率，超出时按显示大小重采样，0为不限制
+	int coordStepBits;	// 图片与文字坐标、行距对齐到1/2^n点（0-5），默认2即0.25点；5为最细的0.03125点
+	int singleByteFont;	// 内容可用单字节代码页表示时，嵌入字体使用单字节编码，0为始终使用UTF-8
+	int standardFont;	// 内容都能用WinAnsi表示时使用Helvetica，不嵌入字体，0为不使用
 } PDFProperty;
 
 typedef struct PDFString
@@ -49,18 +59,28 @@ typedef struct PDFString
 		Align = align;
 		Text  = text;
 	}
+	PDFString(PDFTextAlign align, const QImage &image, const QSizeF &size = QSizeF())
+	{
+		Align	  = align;
+		Image	  = image;
+		ImageSize = size;
+	}
 	PDFString(const PDFString &other)
 	{
 		*this = other;
 	}
 	PDFString &operator=(const PDFString &other)
 	{
-		Align = other.Align;
-		Text  = other.Text;
+		Align	  = other.Align;
+		Text	  = other.Text;
+		Image	  = other.Image;
+		ImageSize = other.ImageSize;
 		return *this;
 	}
 	PDFTextAlign Align;
 	QString   Text;
+	QImage	  Image;		// 段落图片，绘制在Text之前
+	QSizeF	  ImageSize;	// 图片显示大小（点），为空时按图片DPI计算
 } PDFString;
 
 typedef struct PDFItem
@@ -136,19 +156,39 @@ public:
 		return m_ret;
 	}
 
+	// 释放缓存的空闲libharu文档：其中保留了CMap表、CNS字体定义和已加载的整个TrueType字体文件
+	// 空闲文档最多idealThreadCount()个，程序退出前或内存紧张时调用
+	static void releaseCachedDocuments();
+
 private:
 	void initPDF();
-	std::string toLang(const QString &text) const;		// 转换到适合的语言的编码
-	int  contentWidth(const HPDF_Page page, const QList<QString> &lines) const;
-	void HPDF_Page_TextOutEx(HPDF_Page page, int edge, int ypos, PDFTextAlign align, const char *text, int width = 0);
-	QList<QString> wrapString(const QString &text, const QFont &font, int width, int minWord);
+	QByteArray toLang(const QString &text) const;		// 转换到适合的语言的编码
+	QByteArray toOutline(const QString &text) const;	// 转换到书签的编码（UTF-8）
+	void selectFont();						// 按内容选择编码并创建字体
+	void loadSystemFont();					// 查找并加载系统字体，失败时使用SimSun
+	bool canEncode(QTextCodec *codec) const;	// 全部内容能否用codec编码
+	bool fitsWinAnsi() const;				// 全部内容能否用标准14字体显示
+	int  contentWidth(const HPDF_Page page, const QList<QString> &lines);
+	void HPDF_Page_TextOutEx(HPDF_Page page, int edge, int ypos, PDFTextAlign align, const QString &text, int width = 0);
+	HPDF_Page nextPage(HPDF_Page page);		// 结束当前页并开始新页
+	void endText(HPDF_Page page);			// 结束已开始的文本对象
+	void setFontAndSize(HPDF_Page page, HPDF_REAL size);	// 字体或字号变化时才输出
+	void prepareImages();					// 在线程池中预处理所有图片
+	int  estimatePages() const;				// 预估页数，用于预设页树
+	HPDF_REAL pdfReal(double value) const;	// 按coordStepBits对齐坐标，使输出的数字最短
+	HPDF_Image loadImage(const QImage &image);
+	QSizeF imageSize(const PDFString &section) const;
+	HPDF_Page drawImage(HPDF_Page page, const PDFString &section, int &topSpace);
+	QList<QString> wrapString(const QString &text, double fontSize, double width, int minWord);
 
 private:
 	int		m_ret;
 	QSize	m_szPage;
 	int		m_wContent;
 	std::string  m_fName;
-	std::string  m_codecName;
+	std::string  m_encName;			// loadSystemFont选择的libharu编码器
+	std::string  m_codecName;		// loadSystemFont所选编码对应的Qt编码名
+	QTextCodec	*m_codec;			// 所选页面字体编码对应的Qt编码器，由selectFont设置；该编码为UTF-8时为NULL
 
 	PDFContent   m_mContent;
 	PDFProperty	 m_pro;
@@ -156,6 +196,10 @@ private:
 	HPDF_Doc	 m_pdf;
 	HPDF_Font	 m_font;
 	HPDF_Encoder m_encoder;
+	QSharedPointer<PDFWidthTable> m_widths;		// m_font的字宽缓存
+	QHash<qint64, HPDF_Image> m_images;		// QImage::cacheKey -> 已嵌入的图片
+	QHash<qint64, QSharedPointer<PDFImageJob> > m_jobs;	// QImage::cacheKey -> 预处理任务
+	QThreadPool	 m_pool;
 };
 
 #endif // HPDFWRITER_H
\ No newline at end of file